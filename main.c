@@ -1,22 +1,53 @@
 // main.c
-// Linux: gcc -std=c11 -O2 -o zPBPTool main.c
-// macOS: clang -std=c11 -O2 -Wall -Wextra -o zPBPTool main.c
+// Linux: gcc -std=c11 -O2 -pthread -o zPBPTool main.c
+// macOS: clang -std=c11 -O2 -Wall -Wextra -pthread -o zPBPTool main.c
 
 #define _CRT_SECURE_NO_WARNINGS
+#if defined(__linux__) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200112L
+#endif
+#if !defined(_FILE_OFFSET_BITS)
+#define _FILE_OFFSET_BITS 64
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <ctype.h>
 #include <errno.h>
+#include <time.h>
 #include <sys/stat.h>
 
 #if defined(_WIN32)
 #include <direct.h>
+#include <io.h>
 #define mkdir_p(path) _mkdir(path)
+#define fsync_file(f) _commit(_fileno(f))
+#define fseek64(f, off, whence) _fseeki64(f, off, whence)
+#define ftell64(f) _ftelli64(f)
 #else
+#include <unistd.h>
 #define mkdir_p(path) mkdir(path, 0755)
+#define fsync_file(f) fsync(fileno(f))
+#define fseek64(f, off, whence) fseeko(f, (off_t)(off), whence)
+#define ftell64(f) ((long long)ftello(f))
 #endif
 
+#if defined(__linux__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <pthread.h>
+#define HAVE_PREFETCH 1
+#endif
+
+// Read-ahead window used when analyzing a list of files: up to `depth` worker
+// threads read the headers of the next files while the main loop prints, so
+// `depth` is also the number of lookups in flight. It grows only when the main
+// loop had to wait for a header, towards read latency / print time per file,
+// and shrinks back to that target after a run of files without waiting.
+#define PREFETCH_MIN_DEPTH 1
+#define PREFETCH_MAX_DEPTH 32
+#define PREFETCH_STALL_MS 0.25
+
 #pragma pack(push, 1)
 typedef struct {
     uint8_t  signature[4];
@@ -63,40 +94,263 @@ static int validate_header(const PBPHeader* h) {
     return 0;
 }
 
-static void analyze_file(const char* file_path) {
+typedef struct {
+    PBPHeader header;
+    int result;     // 0, or READ_OPEN_FAILED / READ_SHORT
+    int err;        // errno when the open failed
+} HeaderRead;
+
+#define READ_OPEN_FAILED 1
+#define READ_SHORT 2
+
+static void read_header(const char* file_path, HeaderRead* out) {
+    memset(out, 0, sizeof(*out));
     FILE* f = fopen(file_path, "rb");
     if (!f) {
-        fprintf(stderr, "Failed to open '%s': %s\n", file_path, strerror(errno));
-        exit(1);
+        out->result = READ_OPEN_FAILED;
+        out->err = errno;
+        return;
     }
+    if (fread(&out->header, 1, sizeof(out->header), f) != sizeof(out->header)) out->result = READ_SHORT;
+    fclose(f);
+}
 
-    PBPHeader header;
-    if (fread(&header, 1, sizeof(header), f) != sizeof(header)) {
-        fclose(f);
-        print_error_and_exit("Failed to read header");
+// Prints the header of one PBP. Errors are reported and returned instead of
+// exiting, so a list of files keeps going past a bad one.
+static int print_header(const char* file_path, const HeaderRead* r) {
+    if (r->result == READ_OPEN_FAILED) {
+        fprintf(stderr, "Failed to open '%s': %s\n", file_path, strerror(r->err));
+        return -1;
+    }
+    if (r->result == READ_SHORT) {
+        fprintf(stderr, "Error: Failed to read header of '%s'\n", file_path);
+        return -1;
     }
 
-    int v = validate_header(&header);
-    if (v != 0) {
-        fclose(f);
-        print_error_and_exit("Header validation failed");
+    const PBPHeader* header = &r->header;
+    if (validate_header(header) != 0) {
+        fprintf(stderr, "Error: Header validation failed for '%s'\n", file_path);
+        return -1;
     }
 
     printf("PBP Header:\n");
-    printf("\tSignature:\t%c%c%c%c\n", header.signature[0], header.signature[1], header.signature[2], header.signature[3]);
-    printf("\tVersion:\t%u.%u\n", (unsigned)header.version[1], (unsigned)header.version[0]);
+    printf("\tSignature:\t%c%c%c%c\n", header->signature[0], header->signature[1], header->signature[2], header->signature[3]);
+    printf("\tVersion:\t%u.%u\n", (unsigned)header->version[1], (unsigned)header->version[0]);
     printf("Offsets:\n");
     for (size_t i = 0; i < 8; ++i) {
-        uint32_t offset = header.offset[i];
-        if (i + 1 < 8 && header.offset[i + 1] > offset) {
+        uint32_t offset = header->offset[i];
+        if (i + 1 < 8 && header->offset[i + 1] > offset) {
             printf("\t%s:\t%u\n", default_file_names[i], (unsigned)offset);
         }
         else {
             printf("\t%s:\tNULL\n", default_file_names[i]);
         }
     }
+    return 0;
+}
 
-    fclose(f);
+static double now_ms(void) {
+#if defined(HAVE_PREFETCH)
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0) return 0.0;
+    return (double)ts.tv_sec * 1000.0 + (double)ts.tv_nsec / 1000000.0;
+#else
+    return 0.0;
+#endif
+}
+
+#if defined(HAVE_PREFETCH)
+#define SLOT_PENDING 0
+#define SLOT_BUSY 1
+#define SLOT_DONE 2
+
+typedef struct {
+    HeaderRead read;
+    double cost_ms;     // time the read took, wherever it ran
+    int state;
+} PrefetchSlot;
+
+typedef struct Prefetcher Prefetcher;
+
+typedef struct {
+    Prefetcher* pf;
+    int id;
+    pthread_t thread;
+} PrefetchWorker;
+
+// Worker threads for analyze_files. Worker `id` only takes a file while
+// id < active, so at most `active` lookups are outstanding; the headers they
+// read are handed to the main loop, which then does no I/O of its own.
+struct Prefetcher {
+    char** paths;
+    int count;
+    int next;           // next index a worker will read
+    int limit;          // read up to this index (exclusive)
+    int active;
+    int stop;
+    PrefetchSlot* slots;
+    PrefetchWorker workers[PREFETCH_MAX_DEPTH];
+    int worker_count;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;    // workers: more work or stop
+    pthread_cond_t ready;   // main loop: a slot became SLOT_DONE
+};
+
+static void* prefetch_worker(void* arg) {
+    PrefetchWorker* w = arg;
+    Prefetcher* pf = w->pf;
+    pthread_mutex_lock(&pf->lock);
+    for (;;) {
+        while (!pf->stop && (w->id >= pf->active || pf->next >= pf->limit)) {
+            pthread_cond_wait(&pf->wake, &pf->lock);
+        }
+        if (pf->stop) break;
+        PrefetchSlot* slot = &pf->slots[pf->next];
+        const char* path = pf->paths[pf->next++];
+        slot->state = SLOT_BUSY;
+        pthread_mutex_unlock(&pf->lock);
+
+        double start = now_ms();
+        read_header(path, &slot->read);
+        double cost = now_ms() - start;
+
+        pthread_mutex_lock(&pf->lock);
+        slot->cost_ms = cost;
+        slot->state = SLOT_DONE;
+        pthread_cond_broadcast(&pf->ready);
+    }
+    pthread_mutex_unlock(&pf->lock);
+    return NULL;
+}
+
+static void prefetch_start(Prefetcher* pf, int count, char** paths) {
+    memset(pf, 0, sizeof(*pf));
+    pf->paths = paths;
+    pf->count = count;
+    pf->slots = calloc((size_t)count, sizeof(*pf->slots));
+    if (!pf->slots) print_error_and_exit("out of memory");
+    pthread_mutex_init(&pf->lock, NULL);
+    pthread_cond_init(&pf->wake, NULL);
+    pthread_cond_init(&pf->ready, NULL);
+}
+
+// Lets `depth` workers read ahead of file `current`, starting threads as the
+// depth grows. If a thread cannot be started the main loop reads the files
+// the remaining workers do not get to.
+static void prefetch_window(Prefetcher* pf, int current, int depth) {
+    while (pf->worker_count < depth && current + 1 < pf->count) {
+        PrefetchWorker* w = &pf->workers[pf->worker_count];
+        w->pf = pf;
+        w->id = pf->worker_count;
+        if (pthread_create(&w->thread, NULL, prefetch_worker, w) != 0) break;
+        ++pf->worker_count;
+    }
+    pthread_mutex_lock(&pf->lock);
+    if (pf->next <= current) pf->next = current + 1;
+    pf->limit = current + 1 + depth < pf->count ? current + 1 + depth : pf->count;
+    pf->active = depth;
+    pthread_cond_broadcast(&pf->wake);
+    pthread_mutex_unlock(&pf->lock);
+}
+
+// Hands over the header of file `index`, waiting for its worker if needed or
+// reading it here when no worker has picked it up. Returns the read's cost.
+static double prefetch_take(Prefetcher* pf, int index, HeaderRead* out) {
+    PrefetchSlot* slot = &pf->slots[index];
+    pthread_mutex_lock(&pf->lock);
+    if (slot->state == SLOT_PENDING) {
+        slot->state = SLOT_BUSY;
+        if (pf->next <= index) pf->next = index + 1;
+        pthread_mutex_unlock(&pf->lock);
+        double start = now_ms();
+        read_header(pf->paths[index], out);
+        return now_ms() - start;
+    }
+    while (slot->state != SLOT_DONE) pthread_cond_wait(&pf->ready, &pf->lock);
+    *out = slot->read;
+    double cost = slot->cost_ms;
+    pthread_mutex_unlock(&pf->lock);
+    return cost;
+}
+
+static void prefetch_stop(Prefetcher* pf) {
+    pthread_mutex_lock(&pf->lock);
+    pf->stop = 1;
+    pthread_cond_broadcast(&pf->wake);
+    pthread_mutex_unlock(&pf->lock);
+    for (int i = 0; i < pf->worker_count; ++i) pthread_join(pf->workers[i].thread, NULL);
+    pthread_cond_destroy(&pf->ready);
+    pthread_cond_destroy(&pf->wake);
+    pthread_mutex_destroy(&pf->lock);
+    free(pf->slots);
+}
+#else
+typedef struct {
+    char** paths;
+} Prefetcher;
+
+static void prefetch_start(Prefetcher* pf, int count, char** paths) {
+    (void)count;
+    pf->paths = paths;
+}
+
+static void prefetch_window(Prefetcher* pf, int current, int depth) {
+    (void)pf;
+    (void)current;
+    (void)depth;
+}
+
+static double prefetch_take(Prefetcher* pf, int index, HeaderRead* out) {
+    read_header(pf->paths[index], out);
+    return 0.0;
+}
+
+static void prefetch_stop(Prefetcher* pf) {
+    (void)pf;
+}
+#endif
+
+// Returns 0 when every file was analyzed, 1 when any of them failed.
+static int analyze_files(int count, char** paths) {
+    int status = 0;
+    int depth = PREFETCH_MIN_DEPTH;
+    int fast_run = 0;
+    double read_avg = 0.0, print_avg = 0.0;
+    Prefetcher pf;
+    prefetch_start(&pf, count, paths);
+
+    for (int i = 0; i < count; ++i) {
+        prefetch_window(&pf, i, depth);
+
+        HeaderRead r;
+        double wait_start = now_ms();
+        double read_ms = prefetch_take(&pf, i, &r);
+        double print_start = now_ms();
+        if (count > 1) printf("%s:\n", paths[i]);
+        if (print_header(paths[i], &r) != 0) status = 1;
+        double print_ms = now_ms() - print_start;
+        double wait_ms = print_start - wait_start;
+
+        // Keeping the main loop busy needs about read latency / print time
+        // reads in flight.
+        read_avg = i == 0 ? read_ms : read_avg * 0.75 + read_ms * 0.25;
+        print_avg = i == 0 ? print_ms : print_avg * 0.75 + print_ms * 0.25;
+        double ratio = read_avg / (print_avg > 0.001 ? print_avg : 0.001);
+        int target = ratio >= PREFETCH_MAX_DEPTH ? PREFETCH_MAX_DEPTH : (int)ratio + 1;
+
+        if (wait_ms > PREFETCH_STALL_MS) {
+            depth = depth + 1 > target ? depth + 1 : target;
+            if (depth > PREFETCH_MAX_DEPTH) depth = PREFETCH_MAX_DEPTH;
+            fast_run = 0;
+        }
+        else if (depth > target && ++fast_run >= depth) {
+            --depth;
+            fast_run = 0;
+        }
+    }
+
+    prefetch_stop(&pf);
+    return status;
 }
 
 static unsigned char* read_file_to_buffer(const char* path, size_t* out_len) {
@@ -194,15 +448,19 @@ static void unpack_pbp(const char* input_path, const char* dir_path) {
     free(content);
 }
 
+static void init_header(PBPHeader* header) {
+    memset(header, 0, sizeof(*header));
+    header->signature[0] = 0x00;
+    header->signature[1] = 'P';
+    header->signature[2] = 'B';
+    header->signature[3] = 'P';
+    header->version[0] = 0;
+    header->version[1] = 1;
+}
+
 static void pack_pbp(const char* output_path, const char* input_paths[8]) {
     PBPHeader header;
-    memset(&header, 0, sizeof(header));
-    header.signature[0] = 0x00;
-    header.signature[1] = 'P';
-    header.signature[2] = 'B';
-    header.signature[3] = 'P';
-    header.version[0] = 0;
-    header.version[1] = 1;
+    init_header(&header);
 
     unsigned char* contents[8] = { 0 };
     size_t sizes[8] = { 0 };
@@ -253,8 +511,787 @@ static void pack_pbp(const char* output_path, const char* input_paths[8]) {
     for (size_t i = 0; i < 8; ++i) free(contents[i]);
 }
 
+// FAT32 memory-stick images.
+// `install` writes EBOOT.PBP files straight into an image file. The FAT and every
+// directory touched are kept in memory and written back once, after all file
+// data is in place; each file gets one contiguous cluster run that is filled
+// with large sequential writes.
+
+#define FAT_MASK 0x0FFFFFFFu
+#define FAT_EOC 0x0FFFFFFFu
+#define FAT_ENTRY_SIZE 32
+#define FAT_ATTR_LFN 0x0F
+#define FAT_ATTR_VOLUME 0x08
+#define FAT_ATTR_DIR 0x10
+#define FAT_ATTR_ARCHIVE 0x20
+#define INSTALL_CHUNK (1u << 20)
+
+typedef struct {
+    uint32_t first_cluster;
+    uint32_t* clusters;
+    size_t cluster_count;
+    size_t fresh_from;          // clusters from this index on were allocated by this run
+    unsigned char* data;
+    int dirty;
+} FatDir;
+
+typedef struct {
+    FILE* f;
+    uint64_t part_offset;       // byte offset of the volume inside the image
+    uint32_t bytes_per_sector;
+    uint32_t cluster_size;
+    uint32_t reserved_sectors;
+    uint32_t num_fats;
+    uint32_t fat_sectors;
+    uint32_t root_cluster;
+    uint32_t fsinfo_sector;     // 0 when the volume has no usable FSInfo
+    uint64_t data_offset;
+    uint32_t max_cluster;       // highest valid cluster number
+    unsigned char* fat;         // in-memory copy of the first FAT
+    uint32_t dirty_lo, dirty_hi;
+    uint32_t next_free;
+    uint32_t* pending_free;     // chains of replaced files, released in fat_close
+    size_t pending_count;
+    uint16_t date, time;        // timestamp for new and replaced entries
+    FatDir** dirs;
+    size_t dir_count;
+    unsigned char* chunk;
+} FatImage;
+
+static const int lfn_char_offsets[13] = { 1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30 };
+
+static uint16_t rd16(const unsigned char* p) {
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t rd32(const unsigned char* p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void wr16(unsigned char* p, uint32_t v) {
+    p[0] = (unsigned char)v;
+    p[1] = (unsigned char)(v >> 8);
+}
+
+static void wr32(unsigned char* p, uint32_t v) {
+    p[0] = (unsigned char)v;
+    p[1] = (unsigned char)(v >> 8);
+    p[2] = (unsigned char)(v >> 16);
+    p[3] = (unsigned char)(v >> 24);
+}
+
+static void image_seek(FatImage* img, uint64_t offset) {
+    if (fseek64(img->f, img->part_offset + offset, SEEK_SET) != 0) {
+        print_error_and_exit("image seek failed");
+    }
+}
+
+static void image_read(FatImage* img, uint64_t offset, void* buf, size_t len) {
+    image_seek(img, offset);
+    if (fread(buf, 1, len, img->f) != len) print_error_and_exit("image read failed");
+}
+
+static void image_write(FatImage* img, uint64_t offset, const void* buf, size_t len) {
+    image_seek(img, offset);
+    if (fwrite(buf, 1, len, img->f) != len) print_error_and_exit("image write failed");
+}
+
+// Makes everything written so far durable before the next step is written.
+// On macOS fsync only reaches the drive cache, so ask for a full flush first.
+static void image_sync(FatImage* img) {
+    if (fflush(img->f) != 0) print_error_and_exit("Failed to flush image");
+#if defined(__APPLE__)
+    if (fcntl(fileno(img->f), F_FULLFSYNC) == 0) return;
+#endif
+    if (fsync_file(img->f) != 0) print_error_and_exit("Failed to sync image");
+}
+
+static uint64_t cluster_offset(const FatImage* img, uint32_t cluster) {
+    return img->data_offset + (uint64_t)(cluster - 2) * img->cluster_size;
+}
+
+static uint32_t fat_get(const FatImage* img, uint32_t cluster) {
+    return rd32(img->fat + (size_t)cluster * 4) & FAT_MASK;
+}
+
+static void fat_set(FatImage* img, uint32_t cluster, uint32_t value) {
+    unsigned char* p = img->fat + (size_t)cluster * 4;
+    wr32(p, (rd32(p) & ~FAT_MASK) | (value & FAT_MASK));
+    if (cluster < img->dirty_lo) img->dirty_lo = cluster;
+    if (cluster > img->dirty_hi) img->dirty_hi = cluster;
+}
+
+static void fat_open(FatImage* img, const char* path) {
+    memset(img, 0, sizeof(*img));
+    img->f = fopen(path, "r+b");
+    if (!img->f) {
+        fprintf(stderr, "Failed to open image '%s': %s\n", path, strerror(errno));
+        exit(1);
+    }
+
+    unsigned char bs[512];
+    image_read(img, 0, bs, sizeof(bs));
+    if (bs[510] != 0x55 || bs[511] != 0xAA) print_error_and_exit("image has no boot sector");
+
+    // Memory sticks formatted by the PSP carry an MBR in front of the volume.
+    if (rd16(bs + 22) != 0 || rd32(bs + 36) == 0) {
+        for (int i = 0; i < 4; ++i) {
+            const unsigned char* pe = bs + 446 + 16 * i;
+            if (pe[4] == 0x0B || pe[4] == 0x0C) {
+                img->part_offset = (uint64_t)rd32(pe + 8) * 512;
+                break;
+            }
+        }
+        if (img->part_offset == 0) print_error_and_exit("image contains no FAT32 volume");
+        image_read(img, 0, bs, sizeof(bs));
+    }
+
+    uint32_t bps = rd16(bs + 11);
+    uint32_t spc = bs[13];
+    if ((bps != 512 && bps != 1024 && bps != 2048 && bps != 4096) || spc == 0 || (spc & (spc - 1)) != 0 ||
+        bs[16] == 0 || rd16(bs + 17) != 0 || rd16(bs + 22) != 0 || rd32(bs + 36) == 0) {
+        print_error_and_exit("image is not a FAT32 volume");
+    }
+
+    img->bytes_per_sector = bps;
+    img->cluster_size = bps * spc;
+    img->reserved_sectors = rd16(bs + 14);
+    img->num_fats = bs[16];
+    img->fat_sectors = rd32(bs + 36);
+    img->root_cluster = rd32(bs + 44);
+
+    uint64_t total_sectors = rd16(bs + 19) ? rd16(bs + 19) : rd32(bs + 32);
+    uint64_t meta_sectors = img->reserved_sectors + (uint64_t)img->num_fats * img->fat_sectors;
+    uint64_t fat_entries = (uint64_t)img->fat_sectors * bps / 4;
+    if (total_sectors <= meta_sectors) print_error_and_exit("image is not a FAT32 volume");
+    uint64_t clusters = (total_sectors - meta_sectors) / spc;
+    if (clusters + 2 > fat_entries) clusters = fat_entries - 2;
+    if (clusters == 0 || clusters > FAT_MASK - 10) print_error_and_exit("image is not a FAT32 volume");
+    img->max_cluster = (uint32_t)clusters + 1;
+    img->data_offset = meta_sectors * bps;
+    if (img->root_cluster < 2 || img->root_cluster > img->max_cluster) {
+        print_error_and_exit("image has an invalid root directory");
+    }
+
+    size_t fat_bytes = (size_t)img->fat_sectors * bps;
+    img->fat = malloc(fat_bytes);
+    img->chunk = malloc(INSTALL_CHUNK);
+    if (!img->fat || !img->chunk) print_error_and_exit("out of memory");
+    image_read(img, (uint64_t)img->reserved_sectors * bps, img->fat, fat_bytes);
+    img->dirty_lo = UINT32_MAX;
+    img->dirty_hi = 0;
+    img->next_free = 2;
+
+    uint32_t fsinfo = rd16(bs + 48);
+    if (fsinfo != 0 && fsinfo < img->reserved_sectors) {
+        unsigned char fi[512];
+        image_read(img, (uint64_t)fsinfo * bps, fi, sizeof(fi));
+        if (rd32(fi) == 0x41615252 && rd32(fi + 484) == 0x61417272) {
+            img->fsinfo_sector = fsinfo;
+            uint32_t hint = rd32(fi + 492);
+            if (hint >= 2 && hint <= img->max_cluster) img->next_free = hint;
+        }
+    }
+
+    time_t now = time(NULL);
+    struct tm* tm = localtime(&now);
+    if (tm && tm->tm_year >= 80) {
+        img->date = (uint16_t)(((tm->tm_year - 80) << 9) | ((tm->tm_mon + 1) << 5) | tm->tm_mday);
+        img->time = (uint16_t)((tm->tm_hour << 11) | (tm->tm_min << 5) | (tm->tm_sec / 2));
+    }
+    else {
+        img->date = (1 << 5) | 1;
+    }
+}
+
+static uint32_t* fat_chain(const FatImage* img, uint32_t first, size_t* out_count) {
+    size_t cap = 8, n = 0;
+    uint32_t* list = malloc(cap * sizeof(*list));
+    if (!list) print_error_and_exit("out of memory");
+    for (uint32_t c = first; c >= 2 && c <= img->max_cluster; c = fat_get(img, c)) {
+        if (n > img->max_cluster) print_error_and_exit("image has a looping cluster chain");
+        if (n == cap) {
+            cap *= 2;
+            uint32_t* grown = realloc(list, cap * sizeof(*list));
+            if (!grown) print_error_and_exit("out of memory");
+            list = grown;
+        }
+        list[n++] = c;
+    }
+    *out_count = n;
+    return list;
+}
+
+static uint32_t fat_find_run(const FatImage* img, uint32_t from, uint32_t count) {
+    uint32_t run = 0;
+    for (uint32_t c = from; c <= img->max_cluster; ++c) {
+        if (fat_get(img, c) != 0) {
+            run = 0;
+            continue;
+        }
+        if (++run == count) return c - count + 1;
+    }
+    return 0;
+}
+
+// Allocates `count` contiguous clusters and links them into one chain.
+static uint32_t fat_alloc_run(FatImage* img, uint32_t count) {
+    uint32_t first = fat_find_run(img, img->next_free, count);
+    if (first == 0 && img->next_free > 2) first = fat_find_run(img, 2, count);
+    if (first == 0) {
+        fprintf(stderr, "Error: image has no contiguous run of %u free clusters\n", (unsigned)count);
+        exit(1);
+    }
+    for (uint32_t i = 0; i < count; ++i) {
+        fat_set(img, first + i, i + 1 < count ? first + i + 1 : FAT_EOC);
+    }
+    img->next_free = first + count <= img->max_cluster ? first + count : 2;
+    return first;
+}
+
+static void fat_free_chain(FatImage* img, uint32_t first) {
+    size_t n = 0;
+    uint32_t* chain = fat_chain(img, first, &n);
+    for (size_t i = 0; i < n; ++i) fat_set(img, chain[i], 0);
+    free(chain);
+}
+
+// Frees a replaced file's chain only once the directories no longer point at
+// it, so its clusters cannot be handed to a later file of the same run.
+static void fat_defer_free(FatImage* img, uint32_t first) {
+    if (first < 2 || first > img->max_cluster) return;
+    uint32_t* grown = realloc(img->pending_free, (img->pending_count + 1) * sizeof(*grown));
+    if (!grown) print_error_and_exit("out of memory");
+    img->pending_free = grown;
+    img->pending_free[img->pending_count++] = first;
+}
+
+// Writes the dirty part of the in-memory FAT to every FAT copy.
+static void fat_write(FatImage* img) {
+    if (img->dirty_lo > img->dirty_hi) return;
+    size_t bps = img->bytes_per_sector;
+    size_t lo = (size_t)img->dirty_lo * 4 / bps * bps;
+    size_t hi = ((size_t)img->dirty_hi * 4 + 4 + bps - 1) / bps * bps;
+    for (uint32_t k = 0; k < img->num_fats; ++k) {
+        uint64_t fat_start = ((uint64_t)img->reserved_sectors + (uint64_t)k * img->fat_sectors) * bps;
+        image_write(img, fat_start + lo, img->fat + lo, hi - lo);
+    }
+    img->dirty_lo = UINT32_MAX;
+    img->dirty_hi = 0;
+}
+
+static size_t dir_entry_count(const FatImage* img, const FatDir* d) {
+    return d->cluster_count * img->cluster_size / FAT_ENTRY_SIZE;
+}
+
+static FatDir* dir_cache(FatImage* img, FatDir* d) {
+    FatDir** grown = realloc(img->dirs, (img->dir_count + 1) * sizeof(*grown));
+    if (!grown) print_error_and_exit("out of memory");
+    img->dirs = grown;
+    img->dirs[img->dir_count++] = d;
+    return d;
+}
+
+static FatDir* fat_dir(FatImage* img, uint32_t first) {
+    for (size_t i = 0; i < img->dir_count; ++i) {
+        if (img->dirs[i]->first_cluster == first) return img->dirs[i];
+    }
+
+    FatDir* d = calloc(1, sizeof(*d));
+    if (!d) print_error_and_exit("out of memory");
+    d->first_cluster = first;
+    d->clusters = fat_chain(img, first, &d->cluster_count);
+    if (d->cluster_count == 0) print_error_and_exit("image has a broken directory chain");
+    d->fresh_from = d->cluster_count;
+    d->data = malloc(d->cluster_count * img->cluster_size);
+    if (!d->data) print_error_and_exit("out of memory");
+    for (size_t i = 0; i < d->cluster_count; ++i) {
+        image_read(img, cluster_offset(img, d->clusters[i]), d->data + i * img->cluster_size, img->cluster_size);
+    }
+    return dir_cache(img, d);
+}
+
+static void dir_grow(FatImage* img, FatDir* d) {
+    uint32_t c = fat_alloc_run(img, 1);
+    fat_set(img, d->clusters[d->cluster_count - 1], c);
+
+    uint32_t* clusters = realloc(d->clusters, (d->cluster_count + 1) * sizeof(*clusters));
+    unsigned char* data = realloc(d->data, (d->cluster_count + 1) * img->cluster_size);
+    if (!clusters || !data) print_error_and_exit("out of memory");
+    memset(data + d->cluster_count * img->cluster_size, 0, img->cluster_size);
+    clusters[d->cluster_count++] = c;
+    d->clusters = clusters;
+    d->data = data;
+    d->dirty = 1;
+}
+
+static uint32_t entry_cluster(const unsigned char* e) {
+    return ((uint32_t)rd16(e + 20) << 16) | rd16(e + 26);
+}
+
+static void entry_set(const FatImage* img, unsigned char* e, uint32_t cluster, uint32_t size, int created) {
+    wr16(e + 20, cluster >> 16);
+    wr16(e + 26, cluster & 0xFFFF);
+    wr32(e + 28, size);
+    if (created) {
+        wr16(e + 14, img->time);
+        wr16(e + 16, img->date);
+    }
+    wr16(e + 18, img->date);
+    wr16(e + 22, img->time);
+    wr16(e + 24, img->date);
+}
+
+static unsigned char lfn_checksum(const unsigned char* short_name) {
+    unsigned char sum = 0;
+    for (int i = 0; i < 11; ++i) sum = (unsigned char)(((sum & 1) << 7) + (sum >> 1) + short_name[i]);
+    return sum;
+}
+
+static int name_equal(const char* a, const char* b) {
+    for (; *a && *b; ++a, ++b) {
+        if (tolower((unsigned char)*a) != tolower((unsigned char)*b)) return 0;
+    }
+    return *a == *b;
+}
+
+static void short_to_name(const unsigned char* e, char out[13]) {
+    size_t n = 0;
+    for (int i = 0; i < 8 && e[i] != ' '; ++i) out[n++] = (char)(i == 0 && e[0] == 0x05 ? 0xE5 : e[i]);
+    if (e[8] != ' ') {
+        out[n++] = '.';
+        for (int i = 8; i < 11 && e[i] != ' '; ++i) out[n++] = (char)e[i];
+    }
+    out[n] = '\0';
+}
+
+// Returns the index of the short entry for `name` (matched against both the
+// 8.3 and the long name, ignoring case), or -1 when it is not present.
+static long dir_find(const FatImage* img, const FatDir* d, const char* name) {
+    size_t count = dir_entry_count(img, d);
+    char lfn[20 * 13 + 1];
+    int lfn_ok = 0;
+    unsigned char lfn_sum = 0;
+
+    for (size_t i = 0; i < count; ++i) {
+        const unsigned char* e = d->data + i * FAT_ENTRY_SIZE;
+        if (e[0] == 0x00) break;
+        if (e[0] == 0xE5) {
+            lfn_ok = 0;
+            continue;
+        }
+        if ((e[11] & 0x3F) == FAT_ATTR_LFN) {
+            int seq = e[0] & 0x1F;
+            if (e[0] & 0x40) {
+                memset(lfn, 0, sizeof(lfn));
+                lfn_ok = 1;
+                lfn_sum = e[13];
+            }
+            if (!lfn_ok || seq < 1 || seq > 20 || e[13] != lfn_sum) {
+                lfn_ok = 0;
+                continue;
+            }
+            for (int k = 0; k < 13; ++k) {
+                uint16_t ch = rd16(e + lfn_char_offsets[k]);
+                lfn[(seq - 1) * 13 + k] = (char)(ch == 0xFFFF ? 0 : (ch < 0x80 ? ch : '?'));
+            }
+            continue;
+        }
+        if (e[11] & FAT_ATTR_VOLUME) {
+            lfn_ok = 0;
+            continue;
+        }
+
+        char short_name[13];
+        short_to_name(e, short_name);
+        int match = name_equal(short_name, name) || (lfn_ok && lfn_sum == lfn_checksum(e) && name_equal(lfn, name));
+        lfn_ok = 0;
+        if (match) return (long)i;
+    }
+    return -1;
+}
+
+static int dir_has_short(const FatImage* img, const FatDir* d, const unsigned char* short_name) {
+    size_t count = dir_entry_count(img, d);
+    for (size_t i = 0; i < count; ++i) {
+        const unsigned char* e = d->data + i * FAT_ENTRY_SIZE;
+        if (e[0] == 0x00) break;
+        if (e[0] == 0xE5 || (e[11] & 0x3F) == FAT_ATTR_LFN) continue;
+        if (memcmp(e, short_name, 11) == 0) return 1;
+    }
+    return 0;
+}
+
+static int dir_find_free(const FatImage* img, const FatDir* d, size_t needed, size_t* out_index) {
+    size_t count = dir_entry_count(img, d);
+    size_t run = 0;
+    for (size_t i = 0; i < count; ++i) {
+        unsigned char first = d->data[i * FAT_ENTRY_SIZE];
+        if (first != 0x00 && first != 0xE5) {
+            run = 0;
+            continue;
+        }
+        if (++run == needed) {
+            *out_index = i + 1 - needed;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int valid_fat_name(const char* name) {
+    size_t len = strlen(name);
+    if (len == 0 || len > 255 || name[len - 1] == '.' || name[len - 1] == ' ') return 0;
+    for (const char* p = name; *p; ++p) {
+        unsigned char c = (unsigned char)*p;
+        if (c < 0x20 || c >= 0x7F || strchr("\"*/:<>?\\|", c)) return 0;
+    }
+    return 1;
+}
+
+static int is_short_char(char c) {
+    return (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || strchr("!#$%&'()-@^_`{}~", c) != NULL;
+}
+
+// Splits `name` into the upper-case base and extension of its 8.3 alias.
+// Returns 1 when the alias is the name itself, so no long-name entry is needed.
+static int short_name_basis(const char* name, char base[9], char ext[4]) {
+    const char* dot = strrchr(name, '.');
+    if (dot == name) dot = NULL;
+    size_t base_len = dot ? (size_t)(dot - name) : strlen(name);
+    int exact = base_len <= 8 && (!dot || strlen(dot + 1) <= 3);
+    size_t nb = 0, ne = 0;
+
+    for (size_t i = 0; i < base_len; ++i) {
+        char c = name[i];
+        if (c == ' ' || c == '.') {
+            exact = 0;
+            continue;
+        }
+        if (!is_short_char(c)) {
+            exact = 0;
+            c = (c >= 'a' && c <= 'z') ? (char)(c - 'a' + 'A') : '_';
+        }
+        if (nb < 8) base[nb++] = c;
+    }
+    for (const char* p = dot ? dot + 1 : ""; *p; ++p) {
+        char c = *p;
+        if (c == ' ') {
+            exact = 0;
+            continue;
+        }
+        if (!is_short_char(c)) {
+            exact = 0;
+            c = (c >= 'a' && c <= 'z') ? (char)(c - 'a' + 'A') : '_';
+        }
+        if (ne < 3) ext[ne++] = c;
+    }
+    if (nb == 0) {
+        base[nb++] = '_';
+        exact = 0;
+    }
+    base[nb] = '\0';
+    ext[ne] = '\0';
+    return exact;
+}
+
+// Adds `name` to the directory, with long-name entries when it is not a
+// plain 8.3 name, and returns the index of its short entry.
+static size_t dir_add(FatImage* img, FatDir* d, const char* name, uint8_t attr, uint32_t cluster, uint32_t size) {
+    char base[9], ext[4];
+    unsigned char short_name[11];
+    int exact = short_name_basis(name, base, ext);
+    size_t name_len = strlen(name);
+    size_t lfn_count = exact ? 0 : (name_len + 12) / 13;
+
+    memset(short_name, ' ', sizeof(short_name));
+    memcpy(short_name + 8, ext, strlen(ext));
+    if (exact) {
+        memcpy(short_name, base, strlen(base));
+    }
+    else {
+        for (unsigned n = 1;; ++n) {
+            if (n > 999999) print_error_and_exit("no free short name left in directory");
+            char tail[8];
+            size_t tail_len = (size_t)snprintf(tail, sizeof(tail), "~%u", n);
+            size_t keep = strlen(base);
+            if (keep > 8 - tail_len) keep = 8 - tail_len;
+            memset(short_name, ' ', 8);
+            memcpy(short_name, base, keep);
+            memcpy(short_name + keep, tail, tail_len);
+            if (!dir_has_short(img, d, short_name)) break;
+        }
+    }
+
+    size_t index;
+    while (!dir_find_free(img, d, lfn_count + 1, &index)) dir_grow(img, d);
+
+    unsigned char sum = lfn_checksum(short_name);
+    for (size_t k = 0; k < lfn_count; ++k) {
+        unsigned char* e = d->data + (index + k) * FAT_ENTRY_SIZE;
+        size_t seq = lfn_count - k; // the last part of the name is stored first
+        memset(e, 0, FAT_ENTRY_SIZE);
+        e[0] = (unsigned char)(seq | (k == 0 ? 0x40 : 0));
+        e[11] = FAT_ATTR_LFN;
+        e[13] = sum;
+        for (int j = 0; j < 13; ++j) {
+            size_t pos = (seq - 1) * 13 + (size_t)j;
+            uint32_t ch = pos < name_len ? (unsigned char)name[pos] : (pos == name_len ? 0 : 0xFFFF);
+            wr16(e + lfn_char_offsets[j], ch);
+        }
+    }
+
+    unsigned char* e = d->data + (index + lfn_count) * FAT_ENTRY_SIZE;
+    memset(e, 0, FAT_ENTRY_SIZE);
+    memcpy(e, short_name, sizeof(short_name));
+    e[11] = attr;
+    entry_set(img, e, cluster, size, 1);
+    d->dirty = 1;
+    return index + lfn_count;
+}
+
+static FatDir* fat_subdir(FatImage* img, FatDir* parent, const char* name) {
+    long i = dir_find(img, parent, name);
+    if (i >= 0) {
+        const unsigned char* e = parent->data + (size_t)i * FAT_ENTRY_SIZE;
+        if (!(e[11] & FAT_ATTR_DIR)) {
+            fprintf(stderr, "Error: '%s' in image is not a directory\n", name);
+            exit(1);
+        }
+        return fat_dir(img, entry_cluster(e));
+    }
+
+    uint32_t c = fat_alloc_run(img, 1);
+    FatDir* d = calloc(1, sizeof(*d));
+    if (!d) print_error_and_exit("out of memory");
+    d->first_cluster = c;
+    d->clusters = malloc(sizeof(*d->clusters));
+    d->data = calloc(1, img->cluster_size);
+    if (!d->clusters || !d->data) print_error_and_exit("out of memory");
+    d->clusters[0] = c;
+    d->cluster_count = 1;
+    d->dirty = 1;
+
+    // ".." of a directory directly below the root points at cluster 0.
+    uint32_t parent_cluster = parent->first_cluster == img->root_cluster ? 0 : parent->first_cluster;
+    memcpy(d->data, ".          ", 11);
+    d->data[11] = FAT_ATTR_DIR;
+    entry_set(img, d->data, c, 0, 1);
+    memcpy(d->data + FAT_ENTRY_SIZE, "..         ", 11);
+    d->data[FAT_ENTRY_SIZE + 11] = FAT_ATTR_DIR;
+    entry_set(img, d->data + FAT_ENTRY_SIZE, parent_cluster, 0, 1);
+
+    dir_add(img, parent, name, FAT_ATTR_DIR, c, 0);
+    return dir_cache(img, d);
+}
+
+static FILE* open_input(const char* path, uint64_t* out_size) {
+    FILE* f = fopen(path, "rb");
+    if (!f || fseek64(f, 0, SEEK_END) != 0) {
+        fprintf(stderr, "Failed to read input file '%s'\n", path);
+        exit(1);
+    }
+    long long len = ftell64(f);
+    if (len < 0) {
+        fprintf(stderr, "Failed to read input file '%s'\n", path);
+        exit(1);
+    }
+    rewind(f);
+    *out_size = (uint64_t)len;
+    return f;
+}
+
+// Copies `len` bytes from `src` to the current image position.
+static void image_stream(FatImage* img, FILE* src, uint64_t len) {
+    while (len > 0) {
+        size_t n = len > INSTALL_CHUNK ? INSTALL_CHUNK : (size_t)len;
+        if (fread(img->chunk, 1, n, src) != n) print_error_and_exit("Failed to read input file");
+        if (fwrite(img->chunk, 1, n, img->f) != n) print_error_and_exit("image write failed");
+        len -= n;
+    }
+}
+
+typedef struct {
+    const char* name;
+    const char* inputs[8];  // section files, or the finished PBP in inputs[0]
+    int packed;
+    uint64_t sizes[8];
+    uint64_t total;
+    PBPHeader header;       // written in front of packed sections
+    uint32_t first;
+    uint32_t clusters;
+} InstallJob;
+
+// Opens and sizes every input of a job and validates a finished PBP, so a bad
+// path is reported before any data is written to the image.
+static void install_prepare(InstallJob* job) {
+    if (!valid_fat_name(job->name)) {
+        fprintf(stderr, "Error: invalid directory name '%s'\n", job->name);
+        exit(1);
+    }
+
+    if (job->packed) {
+        init_header(&job->header);
+        job->total = sizeof(PBPHeader);
+        for (size_t i = 0; i < 8; ++i) {
+            job->header.offset[i] = (uint32_t)job->total;
+            if (strcmp(job->inputs[i], "NULL") == 0) {
+                job->inputs[i] = NULL;
+                continue;
+            }
+            fclose(open_input(job->inputs[i], &job->sizes[i]));
+            job->total += job->sizes[i];
+            if (job->total > 0xFFFFFFFFu) break;
+        }
+    }
+    else {
+        PBPHeader header;
+        FILE* f = open_input(job->inputs[0], &job->sizes[0]);
+        job->total = job->sizes[0];
+        if (fread(&header, 1, sizeof(header), f) != sizeof(header) || validate_header(&header) != 0) {
+            fprintf(stderr, "Error: '%s' is not a valid PBP\n", job->inputs[0]);
+            exit(1);
+        }
+        fclose(f);
+    }
+    if (job->total > 0xFFFFFFFFu) {
+        fprintf(stderr, "Error: PBP for '%s' exceeds the FAT32 file size limit\n", job->name);
+        exit(1);
+    }
+}
+
+// Writes PSP/GAME/<name>/EBOOT.PBP from a prepared job.
+static void install_pbp(FatImage* img, FatDir* game, InstallJob* job) {
+    job->clusters = (uint32_t)((job->total + img->cluster_size - 1) / img->cluster_size);
+    job->first = fat_alloc_run(img, job->clusters);
+    image_seek(img, cluster_offset(img, job->first));
+    if (job->packed && fwrite(&job->header, 1, sizeof(job->header), img->f) != sizeof(job->header)) {
+        print_error_and_exit("image write failed");
+    }
+    for (size_t i = 0; i < 8; ++i) {
+        if (!job->inputs[i]) continue;
+        uint64_t size = 0;
+        FILE* src = open_input(job->inputs[i], &size);
+        if (size != job->sizes[i]) {
+            fprintf(stderr, "Error: '%s' changed size during install\n", job->inputs[i]);
+            exit(1);
+        }
+        image_stream(img, src, size);
+        fclose(src);
+    }
+
+    FatDir* dir = fat_subdir(img, game, job->name);
+    long i = dir_find(img, dir, "EBOOT.PBP");
+    if (i >= 0) {
+        unsigned char* e = dir->data + (size_t)i * FAT_ENTRY_SIZE;
+        if (e[11] & FAT_ATTR_DIR) print_error_and_exit("EBOOT.PBP in image is a directory");
+        uint32_t old = entry_cluster(e);
+        entry_set(img, e, job->first, (uint32_t)job->total, 0);
+        dir->dirty = 1;
+        fat_defer_free(img, old);
+    }
+    else {
+        dir_add(img, dir, "EBOOT.PBP", FAT_ATTR_ARCHIVE, job->first, (uint32_t)job->total);
+    }
+}
+
+static void dir_write(FatImage* img, const FatDir* d, size_t from, size_t to) {
+    for (size_t c = from; c < to; ++c) {
+        image_write(img, cluster_offset(img, d->clusters[c]), d->data + c * img->cluster_size, img->cluster_size);
+    }
+}
+
+// Commits the run. Each step only makes on-disk structures point at data that
+// is already in place, and is synced before the next one starts, so even a
+// crash or power loss only leaks clusters: file data, new directory clusters,
+// FAT allocations, existing directory clusters, FAT with the chains of
+// replaced files released, FSInfo.
+static void fat_close(FatImage* img) {
+    image_sync(img);
+
+    for (size_t i = 0; i < img->dir_count; ++i) {
+        FatDir* d = img->dirs[i];
+        if (d->dirty) dir_write(img, d, d->fresh_from, d->cluster_count);
+    }
+    image_sync(img);
+    fat_write(img);
+    image_sync(img);
+
+    for (size_t i = 0; i < img->dir_count; ++i) {
+        FatDir* d = img->dirs[i];
+        if (d->dirty) dir_write(img, d, 0, d->fresh_from);
+        free(d->clusters);
+        free(d->data);
+        free(d);
+    }
+    free(img->dirs);
+    image_sync(img);
+
+    for (size_t i = 0; i < img->pending_count; ++i) fat_free_chain(img, img->pending_free[i]);
+    free(img->pending_free);
+    fat_write(img);
+    image_sync(img);
+
+    if (img->fsinfo_sector != 0) {
+        uint32_t free_count = 0;
+        for (uint32_t c = 2; c <= img->max_cluster; ++c) {
+            if (fat_get(img, c) == 0) ++free_count;
+        }
+        unsigned char fi[512];
+        uint64_t offset = (uint64_t)img->fsinfo_sector * img->bytes_per_sector;
+        image_read(img, offset, fi, sizeof(fi));
+        wr32(fi + 488, free_count);
+        wr32(fi + 492, img->next_free);
+        image_write(img, offset, fi, sizeof(fi));
+        image_sync(img);
+    }
+
+    free(img->fat);
+    free(img->chunk);
+    if (fclose(img->f) != 0) print_error_and_exit("Failed to flush image");
+}
+
+static void install_to_image(const char* image_path, int argc, char** argv) {
+    InstallJob* jobs = calloc((size_t)argc, sizeof(*jobs));
+    if (!jobs) print_error_and_exit("out of memory");
+    size_t job_count = 0;
+
+    for (int i = 0; i < argc;) {
+        InstallJob* job = &jobs[job_count++];
+        job->name = argv[i++];
+        if (i < argc && strcmp(argv[i], "--pack") == 0 && i + 9 <= argc) {
+            job->packed = 1;
+            for (int k = 0; k < 8; ++k) job->inputs[k] = argv[i + 1 + k];
+            i += 9;
+        }
+        else if (i < argc && strcmp(argv[i], "--pack") != 0) {
+            job->inputs[0] = argv[i++];
+        }
+        else {
+            fprintf(stderr, "Error: missing input for '%s'\n", job->name);
+            exit(1);
+        }
+        install_prepare(job);
+    }
+
+    FatImage img;
+    fat_open(&img, image_path);
+    FatDir* root = fat_dir(&img, img.root_cluster);
+    FatDir* psp = fat_subdir(&img, root, "PSP");
+    FatDir* game = fat_subdir(&img, psp, "GAME");
+    for (size_t i = 0; i < job_count; ++i) install_pbp(&img, game, &jobs[i]);
+    fat_close(&img);
+
+    for (size_t i = 0; i < job_count; ++i) {
+        printf("PSP/GAME/%s/EBOOT.PBP:\t%llu bytes, clusters %u-%u\n", jobs[i].name,
+            (unsigned long long)jobs[i].total, (unsigned)jobs[i].first,
+            (unsigned)(jobs[i].first + jobs[i].clusters - 1));
+    }
+    free(jobs);
+}
+
 static void print_usage_and_exit(void) {
-    fprintf(stderr, "Usage: pbptool <pack | unpack | analyze | help>\n");
+    fprintf(stderr, "Usage: pbptool <pack | unpack | analyze | install | help>\n");
     exit(1);
 }
 
@@ -284,13 +1321,20 @@ int main(int argc, char** argv) {
     }
     else if (strcmp(cmd, "analyze") == 0) {
         if (argc < 3) {
-            fprintf(stderr, "Usage: pbptool analyze <input.pbp>\n");
+            fprintf(stderr, "Usage: pbptool analyze <input.pbp> [more.pbp ...]\n");
+            return 1;
+        }
+        return analyze_files(argc - 2, argv + 2);
+    }
+    else if (strcmp(cmd, "install") == 0) {
+        if (argc < 6 || strcmp(argv[2], "--image") != 0) {
+            fprintf(stderr, "Usage: pbptool install --image <ms0.img> <gamedir> <eboot.pbp | --pack <param.sfo> <icon0.png> <icon1.pmf> <pic0.png> <pic1.png> <snd0.at3> <data.psp> <data.psar>> [...]\n");
             return 1;
         }
-        analyze_file(argv[2]);
+        install_to_image(argv[3], argc - 4, argv + 4);
     }
     else if (strcmp(cmd, "help") == 0) {
-        printf("Usage: pbptool <pack | unpack | analyze | help>\n");
+        printf("Usage: pbptool <pack | unpack | analyze | install | help>\n");
         return 0;
     }
     else {